@@ -1,12 +1,25 @@
 #include "my_malloc.h"
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
-Metadata *first_free_block = NULL;
-Metadata *last_free_block = NULL;
 Metadata *first_block = NULL;
 size_t data_size = 0;
 size_t free_size = 0;
 
+// Segregated free lists: every free block is linked into the list of its
+// size class through the next/prev fields of its header.
+Metadata *size_class_head[NUM_SIZE_CLASSES];
+unsigned long long size_class_map = 0;
+
+// End of the most recent heap segment. Every segment ends with an allocated
+// fence header so coalescing never runs past memory we do not own.
+static char *heap_end = NULL;
+
+#define ALIGNMENT 16
+#define FENCE_SIZE offsetof(Metadata, next)
+#define MIN_PAYLOAD_SIZE sizeof(size_t)
+
 static void init_block(Metadata *block, size_t size, int isfree) {
     block->size = size;
     block->isfree = isfree;
@@ -14,153 +27,226 @@ static void init_block(Metadata *block, size_t size, int isfree) {
     block->prev = NULL;
 }
 
+static size_t adjust_size(size_t size) {
+    if (size < MIN_PAYLOAD_SIZE) {
+        return MIN_PAYLOAD_SIZE;
+    }
+    return (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static Metadata *next_physical(Metadata *block) {
+    return (Metadata *)((char *)block + sizeof(Metadata) + block->size);
+}
+
+// Only valid when block->prev_isfree is set: the free predecessor keeps a
+// copy of its size in the last word of its payload.
+static Metadata *prev_physical(Metadata *block) {
+    size_t prev_size = *((size_t *)block - 1);
+    return (Metadata *)((char *)block - prev_size - sizeof(Metadata));
+}
+
+static void set_footer(Metadata *block) {
+    *((size_t *)next_physical(block) - 1) = block->size;
+}
+
+// Classes are 16 bytes wide below 64 bytes, then each power of two is split
+// into 4 equally sized classes. Everything past the last class lands in it.
+static int size_class(size_t size) {
+    if (size < 64) {
+        return (int)(size >> 4);
+    }
+    int log2 = 63 - __builtin_clzll((unsigned long long)size);
+    int index = 4 + (log2 - 6) * 4 + (int)((size >> (log2 - 2)) & 3);
+    if (index >= NUM_SIZE_CLASSES) {
+        return NUM_SIZE_CLASSES - 1;
+    }
+    return index;
+}
+
+// Index of the first non-empty class at or above index, or -1.
+static int next_class(int index) {
+    if (index >= NUM_SIZE_CLASSES) {
+        return -1;
+    }
+    unsigned long long map = size_class_map & (~0ULL << index);
+    if (map == 0) {
+        return -1;
+    }
+    return __builtin_ctzll(map);
+}
+
+// Grows the heap by total_size bytes and returns the start of the new
+// region. If nobody else moved the break since our last call, the old fence
+// becomes the start of the region so it stays physically contiguous with
+// (and inherits the prev_isfree bit of) the previous last block.
+static Metadata *extend_heap(size_t total_size) {
+    char *brk = sbrk(0);
+    Metadata *region;
+
+    if (heap_end != NULL && brk == heap_end) {
+        if (sbrk(total_size) == (void *)-1) {
+            return NULL;
+        }
+        region = (Metadata *)(heap_end - FENCE_SIZE);
+        data_size += total_size;
+    } else {
+        size_t padding = (ALIGNMENT - (uintptr_t)brk % ALIGNMENT) % ALIGNMENT;
+        if (sbrk(padding + total_size + FENCE_SIZE) == (void *)-1) {
+            return NULL;
+        }
+        region = (Metadata *)(brk + padding);
+        region->prev_isfree = 0;
+        data_size += padding + total_size + FENCE_SIZE;
+    }
+
+    Metadata *fence = (Metadata *)((char *)region + total_size);
+    fence->size = 0;
+    fence->isfree = 0;
+    fence->prev_isfree = 0;
+    heap_end = (char *)fence + FENCE_SIZE;
+
+    return region;
+}
+
 void *ff_malloc(size_t requested_size) {
-    if (first_free_block != NULL) {
-        Metadata *current_block = first_free_block;
-        
+    requested_size = adjust_size(requested_size);
+    int index = next_class(size_class(requested_size));
+
+    while (index != -1) {
+        Metadata *current_block = size_class_head[index];
+
         while (current_block != NULL) {
             if (current_block->size >= requested_size) {
                 return reuse_block(requested_size, current_block);
             }
             current_block = current_block->next;
         }
+        index = next_class(index + 1);
     }
-    
+
     return allocate_block(requested_size);
 }
 
 void *reuse_block(size_t requested_size, Metadata *block) {
-    size_t min_split_size = requested_size + sizeof(Metadata);
-    if (block->size > min_split_size) {
+    size_t min_split_size = requested_size + sizeof(Metadata) + MIN_PAYLOAD_SIZE;
+
+    remove_block(block);
+    if (block->size >= min_split_size) {
         Metadata *remainder = (Metadata *)((char *)block + sizeof(Metadata) + requested_size);
         init_block(remainder, block->size - requested_size - sizeof(Metadata), 1);
-        
-        remove_block(block);
+        remainder->prev_isfree = 0;
+        set_footer(remainder);
         add_block(remainder);
+
         block->size = requested_size;
         free_size -= (requested_size + sizeof(Metadata));
     } else {
-        remove_block(block);
+        next_physical(block)->prev_isfree = 0;
         free_size -= (block->size + sizeof(Metadata));
     }
-    
+
     block->isfree = 0;
     block->next = NULL;
     block->prev = NULL;
-    
+
     return (char *)block + sizeof(Metadata);
 }
 
 void *allocate_block(size_t requested_size) {
-    size_t total_size = requested_size + sizeof(Metadata);
-    void *memory = sbrk(total_size);
-    if (memory == (void *)-1) {
+    requested_size = adjust_size(requested_size);
+    Metadata *new_block = extend_heap(requested_size + sizeof(Metadata));
+    if (new_block == NULL) {
         return NULL;
     }
-    
-    Metadata *new_block = (Metadata *)memory;
+
     init_block(new_block, requested_size, 0);
-    
-    data_size += total_size;
+
     if (first_block == NULL) {
         first_block = new_block;
     }
-    
+
     return (char *)new_block + sizeof(Metadata);
 }
 
 void add_block(Metadata *block) {
-    if (first_free_block == NULL || block < first_free_block) {
-        block->prev = NULL;
-        block->next = first_free_block;
-        
-        if (first_free_block != NULL) {
-            first_free_block->prev = block;
-        } else {
-            last_free_block = block;
-        }
-        first_free_block = block;
-        return;
-    }
-    
-    Metadata *current = first_free_block;
-    
-    while (current->next != NULL && block > current->next) {
-        current = current->next;
-    }
-    
-    block->prev = current;
-    block->next = current->next;
-    current->next = block;
-    
-    if (block->next != NULL) {
-        block->next->prev = block;
-    } else {
-        last_free_block = block;
+    int index = size_class(block->size);
+
+    block->prev = NULL;
+    block->next = size_class_head[index];
+    if (size_class_head[index] != NULL) {
+        size_class_head[index]->prev = block;
     }
+    size_class_head[index] = block;
+    size_class_map |= 1ULL << index;
 }
 
 void remove_block(Metadata *block) {
-    if (first_free_block == block && last_free_block == block) {
-        first_free_block = NULL;
-        last_free_block = NULL;
-        return;
-    }
-    
-    if (last_free_block == block) {
-        last_free_block = block->prev;
-        last_free_block->next = NULL;
-        return;
+    int index = size_class(block->size);
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        size_class_head[index] = block->next;
+        if (block->next == NULL) {
+            size_class_map &= ~(1ULL << index);
+        }
     }
-    
-    if (first_free_block == block) {
-        first_free_block = block->next;
-        first_free_block->prev = NULL;
-        return;
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
     }
-    
-    block->prev->next = block->next;
-    block->next->prev = block->prev;
 }
 
 void ff_free(void *ptr) {
     Metadata *block = (Metadata *)((char *)ptr - sizeof(Metadata));
-    
+    if (block->isfree) {
+        return;
+    }
+
     block->isfree = 1;
     free_size += block->size + sizeof(Metadata);
-    
-    add_block(block);
-    
-    void *next_physical_addr = (char *)block + block->size + sizeof(Metadata);
-    if (block->next != NULL && next_physical_addr == (char *)block->next) {
-        block->size += sizeof(Metadata) + block->next->size;
-        remove_block(block->next);
+
+    Metadata *next = next_physical(block);
+    if (next->isfree) {
+        remove_block(next);
+        block->size += sizeof(Metadata) + next->size;
     }
-    
-    void *current_physical_addr = (char *)block;
-    if (block->prev != NULL && 
-        (char *)block->prev + block->prev->size + sizeof(Metadata) == current_physical_addr) {
-        block->prev->size += sizeof(Metadata) + block->size;
-        remove_block(block);
+
+    if (block->prev_isfree) {
+        Metadata *prev = prev_physical(block);
+        remove_block(prev);
+        prev->size += sizeof(Metadata) + block->size;
+        block = prev;
     }
+
+    set_footer(block);
+    next_physical(block)->prev_isfree = 1;
+    add_block(block);
 }
 
 void *bf_malloc(size_t size) {
-    Metadata *current = first_free_block;
+    size = adjust_size(size);
+    int index = next_class(size_class(size));
     Metadata *best_fit = NULL;
-    
-    while (current != NULL) {
-        if (current->size >= size) {
-            if (best_fit == NULL || current->size < best_fit->size) {
-                best_fit = current;
-            }
-            if (current->size == size) {
-                break;
+
+    // Classes are ordered by size, so the best fit is in the first class
+    // that holds any block large enough.
+    while (index != -1 && best_fit == NULL) {
+        Metadata *current = size_class_head[index];
+
+        while (current != NULL) {
+            if (current->size >= size) {
+                if (best_fit == NULL || current->size < best_fit->size) {
+                    best_fit = current;
+                }
+                if (current->size == size) {
+                    break;
+                }
             }
+            current = current->next;
         }
-        current = current->next;
+        index = next_class(index + 1);
     }
-    
+
     if (best_fit != NULL) {
         return reuse_block(size, best_fit);
     }
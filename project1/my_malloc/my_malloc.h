@@ -5,14 +5,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// Block header. A free block also keeps a copy of its size in the last
+// word of its payload (the boundary tag read via prev_isfree of the block
+// that physically follows it), so both neighbours are found in O(1).
 struct metadata {
     size_t size;
     int isfree;
+    int prev_isfree;
     struct metadata *next;
     struct metadata *prev;
 };
 typedef struct metadata Metadata;
 
+// Number of segregated size classes (at most 64). Building with
+// -DNUM_SIZE_CLASSES=1 keeps every free block on a single list.
+#ifndef NUM_SIZE_CLASSES
+#define NUM_SIZE_CLASSES 64
+#endif
+
 void *ff_malloc(size_t size);
 void ff_free(void *ptr);
 